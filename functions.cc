@@ -8,7 +8,61 @@
 #include <stack>
 #include <vector>
 
-#define PREFETCH(ptr) _mm_prefetch((const char *)ptr, _MM_HINT_T0)
+/* Written as inline assembly, because __builtin_prefetch only emits
+ * prefetchw when the build enables PRFCHW and a target("prfchw") helper gets
+ * its prefetch dropped when inlined into the loop. CPUs without the
+ * instruction execute it as a NOP. */
+static inline void prefetch_for_write(const void *ptr)
+{
+    asm volatile("prefetchw (%0)" : : "r"(ptr));
+}
+
+template<PrefetchPolicy Policy> static inline void prefetch(const void *ptr)
+{
+    switch (Policy) {
+        case PrefetchPolicy::None:
+            break;
+        case PrefetchPolicy::T0:
+            _mm_prefetch((const char *)ptr, _MM_HINT_T0);
+            break;
+        case PrefetchPolicy::T1:
+            _mm_prefetch((const char *)ptr, _MM_HINT_T1);
+            break;
+        case PrefetchPolicy::T2:
+            _mm_prefetch((const char *)ptr, _MM_HINT_T2);
+            break;
+        case PrefetchPolicy::NTA:
+            _mm_prefetch((const char *)ptr, _MM_HINT_NTA);
+            break;
+        case PrefetchPolicy::Write:
+            prefetch_for_write(ptr);
+            break;
+    }
+}
+
+/* Calls the instantiation of a templated traversal that matches the policy
+ * passed in at runtime, so that the inner loop has no branch on it. */
+#define CALL_WITH_PREFETCH_POLICY(policy, function, ...) \
+    switch (policy) { \
+        case PrefetchPolicy::None: \
+            function<PrefetchPolicy::None>(__VA_ARGS__); \
+            break; \
+        case PrefetchPolicy::T0: \
+            function<PrefetchPolicy::T0>(__VA_ARGS__); \
+            break; \
+        case PrefetchPolicy::T1: \
+            function<PrefetchPolicy::T1>(__VA_ARGS__); \
+            break; \
+        case PrefetchPolicy::T2: \
+            function<PrefetchPolicy::T2>(__VA_ARGS__); \
+            break; \
+        case PrefetchPolicy::NTA: \
+            function<PrefetchPolicy::NTA>(__VA_ARGS__); \
+            break; \
+        case PrefetchPolicy::Write: \
+            function<PrefetchPolicy::Write>(__VA_ARGS__); \
+            break; \
+    }
 
 void foreach_element__single_linked_list(Element *first, Callback callback)
 {
@@ -17,15 +71,23 @@ void foreach_element__single_linked_list(Element *first, Callback callback)
     }
 }
 
-void foreach_element__single_linked_list__with_prefetching(Element *first,
-                                                           Callback callback)
+template<PrefetchPolicy Policy>
+static void single_linked_list__with_prefetching(Element *first,
+                                                 Callback callback)
 {
     for (Element *element = first; element; element = element->next) {
-        PREFETCH(element->next_hint);
+        prefetch<Policy>(element->next_hint);
         callback(element);
     }
 }
 
+void foreach_element__single_linked_list__with_prefetching(
+    Element *first, PrefetchPolicy policy, Callback callback)
+{
+    CALL_WITH_PREFETCH_POLICY(
+        policy, single_linked_list__with_prefetching, first, callback);
+}
+
 void foreach_element__double_linked_list__unordered(Element *first,
                                                     Element *last,
                                                     Callback callback)
@@ -60,8 +122,10 @@ void foreach_element__double_linked_list__unordered(Element *first,
     }
 }
 
-void foreach_element__double_linked_list__unordered__with_prefetching(
-    Element *first, Element *last, Callback callback)
+template<PrefetchPolicy Policy>
+static void double_linked_list__unordered__with_prefetching(Element *first,
+                                                            Element *last,
+                                                            Callback callback)
 {
     if (first == nullptr) {
         return;
@@ -76,8 +140,8 @@ void foreach_element__double_linked_list__unordered__with_prefetching(
     Element *back = last;
 
     while (true) {
-        PREFETCH(front->next_hint);
-        PREFETCH(back->prev_hint);
+        prefetch<Policy>(front->next_hint);
+        prefetch<Policy>(back->prev_hint);
 
         callback(front);
         callback(back);
@@ -96,6 +160,16 @@ void foreach_element__double_linked_list__unordered__with_prefetching(
     }
 }
 
+void foreach_element__double_linked_list__unordered__with_prefetching(
+    Element *first, Element *last, PrefetchPolicy policy, Callback callback)
+{
+    CALL_WITH_PREFETCH_POLICY(policy,
+                              double_linked_list__unordered__with_prefetching,
+                              first,
+                              last,
+                              callback);
+}
+
 void foreach_element__double_linked_list__ordered__std_stack(Element *first,
                                                              Element *last,
                                                              Callback callback)
@@ -271,13 +345,14 @@ void foreach_element__pointer_array(Element **begin,
     }
 }
 
-void foreach_element__pointer_array__with_prefetching(Element **begin,
-                                                      int size,
-                                                      int prefetch_distance,
-                                                      Callback callback)
+template<PrefetchPolicy Policy>
+static void pointer_array__with_prefetching(Element **begin,
+                                            int size,
+                                            int prefetch_distance,
+                                            Callback callback)
 {
     for (int i = 0; i < size - prefetch_distance; i++) {
-        PREFETCH(begin[i + prefetch_distance]);
+        prefetch<Policy>(begin[i + prefetch_distance]);
         callback(begin[i]);
     }
 
@@ -286,6 +361,20 @@ void foreach_element__pointer_array__with_prefetching(Element **begin,
     }
 }
 
+void foreach_element__pointer_array__with_prefetching(Element **begin,
+                                                      int size,
+                                                      int prefetch_distance,
+                                                      PrefetchPolicy policy,
+                                                      Callback callback)
+{
+    CALL_WITH_PREFETCH_POLICY(policy,
+                              pointer_array__with_prefetching,
+                              begin,
+                              size,
+                              prefetch_distance,
+                              callback);
+}
+
 void foreach_element__struct_array(Element *begin, int size, Callback callback)
 {
     for (int i = 0; i < size; i++) {
@@ -14,16 +14,30 @@ static_assert(alignof(Element) == 64, "");
 
 using Callback = void (*)(Element *element);
 
+/* Kind of software prefetch issued by the prefetching traversals. The
+ * temporal hints map to _mm_prefetch. Write always emits prefetchw, which
+ * requests the line in exclusive state because the callback modifies the
+ * element. CPUs without PRFCHW (e.g. Intel before Broadwell) execute it as a
+ * NOP, so there Write behaves like None. */
+enum class PrefetchPolicy {
+    None,
+    T0,
+    T1,
+    T2,
+    NTA,
+    Write,
+};
+
 extern "C" {
 
 void foreach_element__single_linked_list(Element *first, Callback callback);
-void foreach_element__single_linked_list__with_prefetching(Element *first,
-                                                           Callback callback);
+void foreach_element__single_linked_list__with_prefetching(
+    Element *first, PrefetchPolicy policy, Callback callback);
 void foreach_element__double_linked_list__unordered(Element *first,
                                                     Element *last,
                                                     Callback callback);
 void foreach_element__double_linked_list__unordered__with_prefetching(
-    Element *first, Element *last, Callback callback);
+    Element *first, Element *last, PrefetchPolicy policy, Callback callback);
 void foreach_element__double_linked_list__ordered__std_stack(
     Element *first, Element *last, Callback callback);
 void foreach_element__double_linked_list__ordered__std_vector(
@@ -37,6 +51,7 @@ void foreach_element__pointer_array(Element **begin,
 void foreach_element__pointer_array__with_prefetching(Element **begin,
                                                       int size,
                                                       int prefetch_distance,
+                                                      PrefetchPolicy policy,
                                                       Callback callback);
 void foreach_element__struct_array(Element *begin,
                                    int size,
@@ -0,0 +1,220 @@
+#include "hardware_prefetch.hh"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#    include <fcntl.h>
+#    include <unistd.h>
+#endif
+
+/* MISC_FEATURE_CONTROL: the lowest four bits disable the L2 streamer, the L2
+ * adjacent cache line prefetcher, the L1 streamer and the L1 IP-based stride
+ * prefetcher. */
+static const long misc_feature_control = 0x1A4;
+static const uint64_t prefetchers_disable_mask = 0xF;
+
+#ifdef __linux__
+
+/* Models of family 6 that are documented to have the layout above: Nehalem
+ * up to Emerald Rapids, Core and Xeon only. Atom and Xeon Phi parts use
+ * different bits. */
+static const int supported_models[] = {
+    0x1A, 0x1E, 0x1F, 0x2E, 0x25, 0x2C, 0x2F, /* Nehalem, Westmere */
+    0x2A, 0x2D, 0x3A, 0x3E,                   /* Sandy Bridge, Ivy Bridge */
+    0x3C, 0x3F, 0x45, 0x46,                   /* Haswell */
+    0x3D, 0x47, 0x4F, 0x56,                   /* Broadwell */
+    0x4E, 0x5E, 0x55,                         /* Skylake */
+    0x8E, 0x9E, 0xA5, 0xA6,                   /* Kaby, Coffee, Comet Lake */
+    0x66, 0x7D, 0x7E, 0x6A, 0x6C,             /* Cannon Lake, Ice Lake */
+    0x8C, 0x8D, 0xA7,                         /* Tiger Lake, Rocket Lake */
+    0x8F, 0xCF,                               /* Sapphire, Emerald Rapids */
+};
+
+/* One entry for every core that has been changed. The MSR files stay open,
+ * so that restoring only needs async-signal-safe calls. */
+struct ChangedCore {
+    int fd;
+    uint64_t original_value;
+};
+
+static std::vector<ChangedCore> changed_cores;
+
+/* Sticky, so that a failure while rolling back a partial disable is still
+ * reported by the next restore. */
+static volatile std::sig_atomic_t restore_failed = false;
+
+static int get_cpuinfo_number(const std::string &line)
+{
+    size_t colon = line.find(':');
+    return colon == std::string::npos ? -1 :
+                                        std::atoi(line.c_str() + colon + 1);
+}
+
+static bool has_supported_cpu()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    bool is_intel = false;
+    int family = -1;
+    int model = -1;
+    while (std::getline(cpuinfo, line) && line.size() > 0) {
+        if (line.compare(0, 9, "vendor_id") == 0) {
+            is_intel = line.find("GenuineIntel") != std::string::npos;
+        }
+        else if (line.compare(0, 10, "cpu family") == 0) {
+            family = get_cpuinfo_number(line);
+        }
+        else if (line.compare(0, 6, "model\t") == 0) {
+            model = get_cpuinfo_number(line);
+        }
+    }
+    return is_intel && family == 6 &&
+           std::find(std::begin(supported_models),
+                     std::end(supported_models),
+                     model) != std::end(supported_models);
+}
+
+/* Parses a CPU list like "0-3,5,8-11" from /sys. Offline CPUs have no
+ * /dev/cpu/N/msr, so they must be left out. */
+static std::vector<int> get_online_cpus()
+{
+    std::vector<int> cpus;
+    std::ifstream file("/sys/devices/system/cpu/online");
+    std::string range;
+    while (std::getline(file, range, ',')) {
+        int first;
+        int last;
+        char dash;
+        std::istringstream stream(range);
+        if (!(stream >> first)) {
+            return {};
+        }
+        last = first;
+        if (stream >> dash && !(dash == '-' && stream >> last)) {
+            return {};
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+static void restore_at_exit()
+{
+    if (!restore_hardware_prefetchers()) {
+        _exit(EXIT_FAILURE);
+    }
+}
+
+static void restore_and_reraise(int signal)
+{
+    restore_hardware_prefetchers();
+    std::signal(signal, SIG_DFL);
+    std::raise(signal);
+}
+
+/* The prefetchers would stay off for the whole machine until reboot, when
+ * an interrupted run did not restore them. */
+static void register_restore_handlers()
+{
+    static bool is_registered = false;
+    if (is_registered) {
+        return;
+    }
+    is_registered = true;
+    std::atexit(restore_at_exit);
+    std::signal(SIGINT, restore_and_reraise);
+    std::signal(SIGTERM, restore_and_reraise);
+    std::signal(SIGHUP, restore_and_reraise);
+}
+
+bool disable_hardware_prefetchers()
+{
+    if (!changed_cores.empty()) {
+        return true;
+    }
+    if (!has_supported_cpu()) {
+        return false;
+    }
+
+    std::vector<int> cpus = get_online_cpus();
+    if (cpus.empty()) {
+        return false;
+    }
+    changed_cores.reserve(cpus.size());
+    register_restore_handlers();
+
+    for (int cpu : cpus) {
+        std::string path = "/dev/cpu/" + std::to_string(cpu) + "/msr";
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            restore_hardware_prefetchers();
+            return false;
+        }
+        uint64_t value;
+        if (pread(fd, &value, sizeof(value), misc_feature_control) !=
+            sizeof(value)) {
+            close(fd);
+            restore_hardware_prefetchers();
+            return false;
+        }
+        uint64_t new_value = value | prefetchers_disable_mask;
+        if (pwrite(fd, &new_value, sizeof(new_value), misc_feature_control) !=
+            sizeof(new_value)) {
+            close(fd);
+            restore_hardware_prefetchers();
+            return false;
+        }
+        changed_cores.push_back({fd, value});
+    }
+    return true;
+}
+
+/* Only uses async-signal-safe calls, because it also runs in the signal
+ * handlers. */
+bool restore_hardware_prefetchers()
+{
+    bool has_failed_now = false;
+    for (ChangedCore &core : changed_cores) {
+        if (pwrite(core.fd,
+                   &core.original_value,
+                   sizeof(core.original_value),
+                   misc_feature_control) != sizeof(core.original_value)) {
+            has_failed_now = true;
+        }
+        close(core.fd);
+    }
+    changed_cores.clear();
+
+    if (has_failed_now) {
+        static const char message[] =
+            "Cannot restore hardware prefetchers, some stay disabled until "
+            "reboot.\n";
+        ssize_t written = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)written;
+        restore_failed = true;
+    }
+    return !restore_failed;
+}
+
+#else
+
+bool disable_hardware_prefetchers()
+{
+    return false;
+}
+
+bool restore_hardware_prefetchers()
+{
+    return true;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+/* Tries to turn off the hardware prefetchers of all cores, so that only the
+ * software prefetches of the traversals remain. This only works under Linux,
+ * as root, with the msr kernel module loaded and on Intel Core and Xeon CPUs
+ * from Nehalem to Emerald Rapids, which share the layout of MSR 0x1A4. Other
+ * CPUs, including Atom and Xeon Phi, are not touched. Returns false and
+ * leaves everything unchanged when it is not permitted.
+ *
+ * The original state is also restored on exit, SIGINT, SIGTERM and SIGHUP. */
+bool disable_hardware_prefetchers();
+
+/* Restores the state from before disable_hardware_prefetchers(). Returns
+ * false and reports on stderr when that failed for any core, in which case
+ * the process should exit with an error. */
+bool restore_hardware_prefetchers();
@@ -1,5 +1,7 @@
 #include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <random>
@@ -8,6 +10,8 @@
 #include <vector>
 
 #include "functions.hh"
+#include "hardware_prefetch.hh"
+#include "results_store.hh"
 
 static void update_linked_list_pointers(std::vector<Element *> &elements,
                                         int prefetch_hint_distance)
@@ -31,6 +35,55 @@ static void update_linked_list_pointers(std::vector<Element *> &elements,
     }
 }
 
+struct PrefetchConfig {
+    PrefetchPolicy policy;
+    int distance;
+    std::string name;
+};
+
+static const char *prefetch_policy_name(PrefetchPolicy policy)
+{
+    switch (policy) {
+        case PrefetchPolicy::None:
+            return "none";
+        case PrefetchPolicy::T0:
+            return "T0";
+        case PrefetchPolicy::T1:
+            return "T1";
+        case PrefetchPolicy::T2:
+            return "T2";
+        case PrefetchPolicy::NTA:
+            return "NTA";
+        case PrefetchPolicy::Write:
+            return "write";
+    }
+    return "";
+}
+
+/* Every policy at every distance. Without prefetching the distance does not
+ * matter, so that is measured only once. */
+static std::vector<PrefetchConfig> get_prefetch_configs()
+{
+    std::vector<PrefetchPolicy> policies = {PrefetchPolicy::T0,
+                                            PrefetchPolicy::T1,
+                                            PrefetchPolicy::T2,
+                                            PrefetchPolicy::NTA,
+                                            PrefetchPolicy::Write};
+    std::vector<int> distances = {0, 1, 2, 4, 8, 16, 32, 64};
+
+    std::vector<PrefetchConfig> configs;
+    configs.push_back({PrefetchPolicy::None, 0, "(policy=none)"});
+    for (PrefetchPolicy policy : policies) {
+        for (int distance : distances) {
+            std::string name = std::string("(policy=") +
+                               prefetch_policy_name(policy) +
+                               ", distance=" + std::to_string(distance) + ")";
+            configs.push_back({policy, distance, name});
+        }
+    }
+    return configs;
+}
+
 class Benchmark {
   private:
     std::unordered_map<std::string, std::vector<std::chrono::nanoseconds>>
@@ -57,7 +110,7 @@ class Benchmark {
         std::sort(averages.begin(), averages.end());
 
         for (auto result : averages) {
-            std::cout << std::left << std::setw(70) << result.second
+            std::cout << std::left << std::setw(80) << result.second
                       << std::setprecision(5) << (result.first / 1.0e6)
                       << " ms\n";
         }
@@ -68,6 +121,16 @@ class Benchmark {
         return m_results.size();
     }
 
+    void copy_samples_to(BenchmarkRun &run)
+    {
+        for (auto &result : m_results) {
+            std::vector<long long> &samples = run.samples_ns[result.first];
+            for (std::chrono::nanoseconds measurement : result.second) {
+                samples.push_back(measurement.count());
+            }
+        }
+    }
+
     class Timer {
       private:
         Benchmark &m_benchmark;
@@ -91,12 +154,11 @@ class Benchmark {
     };
 };
 
-void run_benchmarks(std::vector<Element> &elements,
+void run_benchmarks(Benchmark &benchmark,
+                    std::vector<Element> &elements,
                     std::vector<Element *> &sorted_element_pointers,
                     std::vector<Element *> &randomized_element_pointers)
 {
-    Benchmark benchmark;
-
 #define SCOPED_BENCHMARK(name) \
     clobber_cache(); \
     Benchmark::Timer timer(benchmark, (name))
@@ -104,7 +166,7 @@ void run_benchmarks(std::vector<Element> &elements,
     int size = elements.size();
     auto callback = [](Element *element) { element->value++; };
 
-    std::vector<int> prefetch_distances = {0, 1, 2, 4, 8, 16, 32, 64};
+    std::vector<PrefetchConfig> prefetch_configs = get_prefetch_configs();
 
     int iterations = 10;
 
@@ -131,16 +193,14 @@ void run_benchmarks(std::vector<Element> &elements,
                                                 callback);
         }
         {
-            for (int prefetch_distance : prefetch_distances) {
-
+            for (const PrefetchConfig &config : prefetch_configs) {
                 update_linked_list_pointers(randomized_element_pointers,
-                                            prefetch_distance);
+                                            config.distance);
                 SCOPED_BENCHMARK(
-                    "Randomized Single Linked List with Prefetching "
-                    "(distance=" +
-                    std::to_string(prefetch_distance) + ")");
+                    "Randomized Single Linked List with Prefetching " +
+                    config.name);
                 foreach_element__single_linked_list__with_prefetching(
-                    randomized_element_pointers[0], callback);
+                    randomized_element_pointers[0], config.policy, callback);
             }
         }
         {
@@ -152,16 +212,16 @@ void run_benchmarks(std::vector<Element> &elements,
                 callback);
         }
         {
-            for (int prefetch_distance : prefetch_distances) {
+            for (const PrefetchConfig &config : prefetch_configs) {
                 update_linked_list_pointers(randomized_element_pointers,
-                                            prefetch_distance);
+                                            config.distance);
                 SCOPED_BENCHMARK(
-                    "Randomized Double Linked List with Prefetching "
-                    "(distance=" +
-                    std::to_string(prefetch_distance) + ")");
+                    "Randomized Double Linked List with Prefetching " +
+                    config.name);
                 foreach_element__double_linked_list__unordered__with_prefetching(
                     randomized_element_pointers[0],
                     randomized_element_pointers[size - 1],
+                    config.policy,
                     callback);
             }
         }
@@ -224,26 +284,26 @@ void run_benchmarks(std::vector<Element> &elements,
                 sorted_element_pointers.data(), size, callback);
         }
         {
-            for (int prefetch_distance : prefetch_distances) {
-                SCOPED_BENCHMARK(
-                    "Randomized Pointer Array with Prefetching (distance=" +
-                    std::to_string(prefetch_distance) + ")");
+            for (const PrefetchConfig &config : prefetch_configs) {
+                SCOPED_BENCHMARK("Randomized Pointer Array with Prefetching " +
+                                 config.name);
                 foreach_element__pointer_array__with_prefetching(
                     randomized_element_pointers.data(),
                     size,
-                    prefetch_distance,
+                    config.distance,
+                    config.policy,
                     callback);
             }
         }
         {
-            for (int prefetch_distance : prefetch_distances) {
-                SCOPED_BENCHMARK(
-                    "Sorted Pointer Array with Prefetching (distance=" +
-                    std::to_string(prefetch_distance) + ")");
+            for (const PrefetchConfig &config : prefetch_configs) {
+                SCOPED_BENCHMARK("Sorted Pointer Array with Prefetching " +
+                                 config.name);
                 foreach_element__pointer_array__with_prefetching(
                     sorted_element_pointers.data(),
                     size,
-                    prefetch_distance,
+                    config.distance,
+                    config.policy,
                     callback);
             }
         }
@@ -278,8 +338,108 @@ void run_benchmarks(std::vector<Element> &elements,
     std::cout << "Errors: " << error_count << "\n";
 }
 
+/* Only accepts text that is a number as a whole. */
+static bool parse_double(const char *text, double &r_value)
+{
+    char *end;
+    r_value = std::strtod(text, &end);
+    return end != text && *end == '\0';
+}
+
+static void print_usage(const char *program)
+{
+    std::cout << "Usage: " << program << " [options]\n"
+              << "  --save <store>       Append this run to the results "
+                 "store. Skipped when\n"
+              << "                       --compare found a regression, so "
+                 "that a slower run\n"
+              << "                       never becomes the next "
+                 "baseline.\n"
+              << "  --compare <store>    Compare against the latest run in "
+                 "the store with\n"
+              << "                       the same machine, compiler and "
+                 "flags. Exits with 1\n"
+              << "                       when a benchmark got slower and "
+                 "with 3 when the\n"
+              << "                       store has no run with the same "
+                 "key or the\n"
+              << "                       benchmarks of the runs do not "
+                 "match.\n"
+              << "  --threshold <ratio>  Minimal relative slowdown to report, "
+                 "at least 0\n"
+              << "                       (default 0.05).\n"
+              << "  --alpha <p>          Significance level between 0 and 1 "
+                 "(default 0.01).\n"
+              << "  --disable-hw-prefetch\n"
+              << "                       Turn off the hardware prefetchers "
+                 "through MSRs\n"
+              << "                       while benchmarking, when "
+                 "permitted.\n";
+}
+
 int main(int argc, char const *argv[])
 {
+    std::string save_path;
+    std::string compare_path;
+    double slowdown_threshold = 0.05;
+    double significance_level = 0.01;
+    bool disable_hw_prefetch = false;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (std::strcmp(argv[i], "--save") == 0 && has_value) {
+            save_path = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--compare") == 0 && has_value) {
+            compare_path = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--threshold") == 0 && has_value &&
+                 parse_double(argv[i + 1], slowdown_threshold) &&
+                 slowdown_threshold >= 0.0) {
+            i++;
+        }
+        else if (std::strcmp(argv[i], "--alpha") == 0 && has_value &&
+                 parse_double(argv[i + 1], significance_level) &&
+                 significance_level > 0.0 && significance_level < 1.0) {
+            i++;
+        }
+        else if (std::strcmp(argv[i], "--disable-hw-prefetch") == 0) {
+            disable_hw_prefetch = true;
+        }
+        else {
+            print_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    BenchmarkRun run = make_benchmark_run_for_this_build();
+
+    /* Done before loading the baseline, because it is part of the key. */
+    if (disable_hw_prefetch) {
+        if (disable_hardware_prefetchers()) {
+            std::cout << "Hardware prefetchers disabled.\n";
+            run.flags += " [hw prefetch off]";
+        }
+        else {
+            std::cout << "Cannot disable hardware prefetchers, skipping.\n";
+        }
+    }
+
+    /* Load the baseline before running, so that a broken store does not
+     * waste a full benchmark run. */
+    std::vector<BenchmarkRun> stored_runs;
+    const BenchmarkRun *baseline = nullptr;
+    if (!compare_path.empty()) {
+        if (!load_results_store(compare_path, stored_runs)) {
+            restore_hardware_prefetchers();
+            return 2;
+        }
+        baseline = find_latest_baseline(stored_runs, run.key());
+        if (baseline == nullptr) {
+            std::cout << "No baseline for: " << run.key() << "\n";
+        }
+    }
+
     const int amount = 1'000'000;
 
     std::vector<Element> elements(amount);
@@ -296,8 +456,39 @@ int main(int argc, char const *argv[])
                  randomized_element_pointers.end(),
                  std::default_random_engine());
 
-    run_benchmarks(
-        elements, sorted_element_pointers, randomized_element_pointers);
+    Benchmark benchmark;
+    run_benchmarks(benchmark,
+                   elements,
+                   sorted_element_pointers,
+                   randomized_element_pointers);
+    if (!restore_hardware_prefetchers()) {
+        return 2;
+    }
+    benchmark.copy_samples_to(run);
+
+    /* Comparing nothing must not look like a pass, e.g. after a compiler
+     * update changed the key. */
+    int exit_code = 0;
+    if (!compare_path.empty() && baseline == nullptr) {
+        exit_code = 3;
+    }
+    else if (baseline != nullptr) {
+        BenchmarkComparison comparison = compare_benchmark_runs(
+            *baseline, run, slowdown_threshold, significance_level);
+        if (comparison.regression_count > 0) {
+            exit_code = 1;
+        }
+        else if (comparison.unmatched_count > 0) {
+            exit_code = 3;
+        }
+    }
+    /* The latest run is the next baseline, so saving regressions would let
+     * a slow drift pass unnoticed. */
+    if (!save_path.empty() && exit_code != 1) {
+        if (!append_to_results_store(save_path, run)) {
+            return 2;
+        }
+    }
 
-    return 0;
+    return exit_code;
 }
@@ -0,0 +1,357 @@
+#include "results_store.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+/* Pass the real compiler flags with e.g.
+ * -DBENCHMARK_FLAGS="\"$CXXFLAGS\"" so that they become part of the key. */
+#ifndef BENCHMARK_FLAGS
+#    define BENCHMARK_FLAGS ""
+#endif
+
+static const char *store_header = "iteration_analysis-results";
+static const int store_version = 1;
+
+std::string BenchmarkRun::key() const
+{
+    return machine + " | " + compiler + " | " + flags;
+}
+
+/* Tabs and newlines separate fields in the store file. */
+static std::string sanitize(std::string value)
+{
+    for (char &c : value) {
+        if (c == '\t' || c == '\n' || c == '\r') {
+            c = ' ';
+        }
+    }
+    return value;
+}
+
+static std::string get_machine_fingerprint()
+{
+    std::string cpu_model = "unknown cpu";
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                cpu_model = line.substr(
+                    line.find_first_not_of(' ', colon + 1));
+            }
+            break;
+        }
+    }
+    return sanitize(cpu_model) + ", " +
+           std::to_string(std::thread::hardware_concurrency()) + " threads";
+}
+
+static std::string get_compiler()
+{
+#if defined(__clang__)
+    return sanitize("clang " __clang_version__);
+#elif defined(__GNUC__)
+    return sanitize("gcc " __VERSION__);
+#elif defined(_MSC_VER)
+    return "msvc " + std::to_string(_MSC_FULL_VER);
+#else
+    return "unknown compiler";
+#endif
+}
+
+static std::string get_flags()
+{
+    std::string flags = BENCHMARK_FLAGS;
+#ifdef __OPTIMIZE__
+    flags += " [optimized]";
+#endif
+#ifdef NDEBUG
+    flags += " [NDEBUG]";
+#endif
+#ifdef __AVX2__
+    flags += " [avx2]";
+#endif
+#ifdef __AVX512F__
+    flags += " [avx512f]";
+#endif
+    size_t start = flags.find_first_not_of(' ');
+    return start == std::string::npos ? "" : sanitize(flags.substr(start));
+}
+
+static std::string get_utc_timestamp()
+{
+    std::time_t now = std::time(nullptr);
+    char buffer[32];
+    std::strftime(
+        buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    return buffer;
+}
+
+BenchmarkRun make_benchmark_run_for_this_build()
+{
+    BenchmarkRun run;
+    run.timestamp = get_utc_timestamp();
+    run.machine = get_machine_fingerprint();
+    run.compiler = get_compiler();
+    run.flags = get_flags();
+    return run;
+}
+
+/* The store is a plain text file, so that it can be inspected and merged by
+ * hand:
+ *
+ *   iteration_analysis-results 1
+ *   run
+ *   timestamp<TAB>2020-01-01T00:00:00Z
+ *   machine<TAB>...
+ *   compiler<TAB>...
+ *   flags<TAB>...
+ *   sample<TAB><benchmark name><TAB><ns> <ns> ...
+ *   end
+ */
+static bool read_store_header(std::istream &file, const std::string &path)
+{
+    std::string header;
+    int version = 0;
+    file >> header >> version;
+    if (header != store_header || version != store_version) {
+        std::cerr << "Unsupported results store: " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool load_results_store(const std::string &path,
+                        std::vector<BenchmarkRun> &r_runs)
+{
+    std::ifstream file(path);
+    if (!file) {
+        /* A missing store is just empty. */
+        return true;
+    }
+    if (!read_store_header(file, path)) {
+        return false;
+    }
+
+    BenchmarkRun *run = nullptr;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        if (line == "run") {
+            r_runs.emplace_back();
+            run = &r_runs.back();
+            continue;
+        }
+        if (line == "end") {
+            run = nullptr;
+            continue;
+        }
+        size_t tab = line.find('\t');
+        if (run == nullptr || tab == std::string::npos) {
+            std::cerr << "Malformed line in " << path << ": " << line << "\n";
+            return false;
+        }
+        std::string field = line.substr(0, tab);
+        std::string value = line.substr(tab + 1);
+        if (field == "timestamp") {
+            run->timestamp = value;
+        }
+        else if (field == "machine") {
+            run->machine = value;
+        }
+        else if (field == "compiler") {
+            run->compiler = value;
+        }
+        else if (field == "flags") {
+            run->flags = value;
+        }
+        else if (field == "sample") {
+            size_t name_end = value.find('\t');
+            if (name_end == std::string::npos) {
+                std::cerr << "Malformed sample in " << path << ": " << line
+                          << "\n";
+                return false;
+            }
+            std::vector<long long> &samples =
+                run->samples_ns[value.substr(0, name_end)];
+            std::istringstream stream(value.substr(name_end + 1));
+            long long sample;
+            while (stream >> sample) {
+                samples.push_back(sample);
+            }
+        }
+    }
+    return true;
+}
+
+bool append_to_results_store(const std::string &path, const BenchmarkRun &run)
+{
+    /* Never append to files that are not a store, e.g. results.txt. */
+    std::ifstream existing(path);
+    bool is_new = !existing ||
+                  existing.peek() == std::ifstream::traits_type::eof();
+    if (!is_new && !read_store_header(existing, path)) {
+        return false;
+    }
+    existing.close();
+
+    std::ofstream file(path, std::ios::app);
+    if (!file) {
+        std::cerr << "Cannot write results store: " << path << "\n";
+        return false;
+    }
+
+    if (is_new) {
+        file << store_header << " " << store_version << "\n";
+    }
+    file << "run\n";
+    file << "timestamp\t" << run.timestamp << "\n";
+    file << "machine\t" << run.machine << "\n";
+    file << "compiler\t" << run.compiler << "\n";
+    file << "flags\t" << run.flags << "\n";
+    for (auto &item : run.samples_ns) {
+        file << "sample\t" << sanitize(item.first) << "\t";
+        for (size_t i = 0; i < item.second.size(); i++) {
+            file << (i == 0 ? "" : " ") << item.second[i];
+        }
+        file << "\n";
+    }
+    file << "end\n";
+    return bool(file);
+}
+
+const BenchmarkRun *find_latest_baseline(const std::vector<BenchmarkRun> &runs,
+                                         const std::string &key)
+{
+    for (size_t i = runs.size(); i--;) {
+        if (runs[i].key() == key) {
+            return &runs[i];
+        }
+    }
+    return nullptr;
+}
+
+static double median(std::vector<long long> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t size = values.size();
+    if (size % 2 == 1) {
+        return values[size / 2];
+    }
+    return (values[size / 2 - 1] + values[size / 2]) / 2.0;
+}
+
+/* One-sided Mann-Whitney U test with the alternative hypothesis that the
+ * current samples tend to be larger (slower) than the baseline samples.
+ * Uses the normal approximation with tie and continuity correction. Timings
+ * are rarely normally distributed, so a rank test is more robust than a
+ * t-test here. */
+static double slowdown_p_value(const std::vector<long long> &baseline,
+                               const std::vector<long long> &current)
+{
+    std::vector<std::pair<long long, bool>> all;
+    for (long long value : baseline) {
+        all.emplace_back(value, false);
+    }
+    for (long long value : current) {
+        all.emplace_back(value, true);
+    }
+    std::sort(all.begin(), all.end());
+
+    double n_baseline = baseline.size();
+    double n_current = current.size();
+    double n = all.size();
+
+    double current_rank_sum = 0.0;
+    double tie_term = 0.0;
+    for (size_t i = 0; i < all.size();) {
+        size_t j = i;
+        while (j < all.size() && all[j].first == all[i].first) {
+            j++;
+        }
+        double tie_count = j - i;
+        double average_rank = (i + 1 + j) / 2.0;
+        for (size_t k = i; k < j; k++) {
+            if (all[k].second) {
+                current_rank_sum += average_rank;
+            }
+        }
+        tie_term += tie_count * tie_count * tie_count - tie_count;
+        i = j;
+    }
+
+    double u = current_rank_sum - n_current * (n_current + 1) / 2.0;
+    double mean = n_baseline * n_current / 2.0;
+    double variance = n_baseline * n_current / 12.0 *
+                      ((n + 1) - tie_term / (n * (n - 1)));
+    if (variance <= 0.0) {
+        return 1.0;
+    }
+    double z = (u - mean - 0.5) / std::sqrt(variance);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+BenchmarkComparison compare_benchmark_runs(const BenchmarkRun &baseline,
+                                           const BenchmarkRun &current,
+                                           double slowdown_threshold,
+                                           double significance_level)
+{
+    std::cout << "Comparing against baseline from " << baseline.timestamp
+              << "\n\n";
+
+    BenchmarkComparison comparison;
+    for (auto &item : current.samples_ns) {
+        const std::string &name = item.first;
+        std::cout << std::left << std::setw(80) << name;
+
+        auto baseline_item = baseline.samples_ns.find(name);
+        if (baseline_item == baseline.samples_ns.end() ||
+            baseline_item->second.size() < 2 || item.second.size() < 2) {
+            std::cout << "no baseline\n";
+            comparison.unmatched_count++;
+            continue;
+        }
+
+        double baseline_median = median(baseline_item->second);
+        double current_median = median(item.second);
+        double change = current_median / baseline_median - 1.0;
+        double p_value = slowdown_p_value(baseline_item->second, item.second);
+
+        bool is_regression = change > slowdown_threshold &&
+                             p_value < significance_level;
+        if (is_regression) {
+            comparison.regression_count++;
+        }
+
+        std::ostringstream change_text;
+        change_text << std::showpos << std::fixed << std::setprecision(1)
+                    << (change * 100.0) << "%";
+        std::cout << std::right << std::setw(8) << change_text.str()
+                  << "  p=" << std::fixed << std::setprecision(4) << p_value
+                  << std::defaultfloat << (is_regression ? "  SLOWER" : "")
+                  << "\n";
+    }
+
+    /* Renamed or removed benchmarks must not silently drop out of the
+     * comparison. */
+    for (auto &item : baseline.samples_ns) {
+        if (current.samples_ns.count(item.first) == 0) {
+            std::cout << std::left << std::setw(80) << item.first
+                      << "not measured\n";
+            comparison.unmatched_count++;
+        }
+    }
+
+    std::cout << "\nRegressions: " << comparison.regression_count << "\n";
+    std::cout << "Unmatched: " << comparison.unmatched_count << "\n";
+    return comparison;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+/* All measurements of one benchmark executable invocation. Runs are only
+ * comparable when they share the same key (machine, compiler and flags). */
+struct BenchmarkRun {
+    std::string timestamp;
+    std::string machine;
+    std::string compiler;
+    std::string flags;
+    std::map<std::string, std::vector<long long>> samples_ns;
+
+    std::string key() const;
+};
+
+BenchmarkRun make_benchmark_run_for_this_build();
+
+bool load_results_store(const std::string &path,
+                        std::vector<BenchmarkRun> &r_runs);
+bool append_to_results_store(const std::string &path,
+                             const BenchmarkRun &run);
+
+const BenchmarkRun *find_latest_baseline(const std::vector<BenchmarkRun> &runs,
+                                         const std::string &key);
+
+struct BenchmarkComparison {
+    /* Benchmarks that are significantly slower than the baseline by more
+     * than the threshold. */
+    int regression_count = 0;
+    /* Benchmarks that only exist in one of the runs, or have too few
+     * samples in one of them to be compared. */
+    int unmatched_count = 0;
+};
+
+/* Prints a per-benchmark comparison. The slowdown threshold is relative,
+ * e.g. 0.05 for 5%. */
+BenchmarkComparison compare_benchmark_runs(const BenchmarkRun &baseline,
+                                           const BenchmarkRun &current,
+                                           double slowdown_threshold,
+                                           double significance_level);